@@ -19,23 +19,32 @@
 
 /** Include standard C headers */
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "lv2/atom/atom.h"
 #include "lv2/atom/util.h"
+#include "lv2/options/options.h"
 #include "lv2/time/time.h"
 #include "lv2/urid/urid.h"
 #include <lv2/core/lv2.h>
 #include <lv2/midi/midi.h>
 
 #define ALO_URI "http://ktano-studio.com/aloschen"
+#define ALO__numLoops ALO_URI "#numLoops"
+#define ALO__loopLength ALO_URI "#loopLength"
+#define ALO__lockBudget ALO_URI "#lockBudget"
 
 typedef struct {
   LV2_URID atom_Blank;
   LV2_URID atom_Float;
+  LV2_URID atom_Int;
   LV2_URID atom_Object;
   LV2_URID midi_MidiEvent;
   LV2_URID atom_Path;
@@ -46,6 +55,9 @@ typedef struct {
   LV2_URID time_beatsPerMinute;
   LV2_URID time_beatsPerBar;
   LV2_URID time_speed;
+  LV2_URID alo_numLoops;
+  LV2_URID alo_loopLength;
+  LV2_URID alo_lockBudget;
 } AloURIs;
 
 typedef enum {
@@ -69,6 +81,14 @@ typedef enum {
   ALO_MIX = 17,
   ALO_RESET_MODE = 18,
   ALO_ENABLED = 19,
+  ALO_QUANTIZE = 20,
+  ALO_READY = 21,
+  ALO_LEVEL1 = 22,
+  ALO_LEVEL2 = 23,
+  ALO_LEVEL3 = 24,
+  ALO_LEVEL4 = 25,
+  ALO_LEVEL5 = 26,
+  ALO_LEVEL6 = 27,
 } PortIndex;
 
 typedef enum {
@@ -85,8 +105,33 @@ typedef enum {
   STATE_SILENT  // Silent
 } ClickState;
 
-static const size_t LOOP_SIZE = 2880000;
+typedef enum {
+  QUANTIZE_OFF,  // apply loop transitions as soon as the event arrives
+  QUANTIZE_BEAT, // wait for the next beat
+  QUANTIZE_BAR,  // wait for the next bar
+  QUANTIZE_LOOP  // wait for the loop to wrap
+} Quantize;
+
+// A loop state change waiting for its quantized sample time
+typedef struct {
+  uint64_t time; // absolute frame at which the action is applied
+  int32_t loop;  // loop the action applies to
+  State state;   // state the loop moves into
+} Action;
+
+// Loop count and length can be set per instance with the numLoops and
+// loopLength (seconds) options, NUM_LOOPS is also the number of loop ports
+static const size_t DEFAULT_LOOP_SIZE = 2880000;
 static const int NUM_LOOPS = 6;
+static const float MAX_LOOP_LENGTH = 600.0f;
+static const size_t CACHE_LINE = 64;
+
+// Upper bound on the loop memory of one instance, override with
+// -DALO_MAX_LOOP_MEMORY_MB=n.  Longer loops are shortened to fit.
+#ifndef ALO_MAX_LOOP_MEMORY_MB
+#define ALO_MAX_LOOP_MEMORY_MB 256
+#endif
+static const int MAX_ACTIONS = 32;
 static const bool LOG_ENABLED = true;
 
 #define DEFAULT_BEATS_PER_BAR 4
@@ -94,6 +139,27 @@ static const bool LOG_ENABLED = true;
 #define DEFAULT_BPM 120
 #define DEFAULT_INSTANT_LOOPS 0
 
+// Default upper bound on loop memory locked into RAM, can be set per instance
+// with the lockBudget option (MB, 0 only prefaults, nothing is locked)
+#ifndef ALO_LOCK_BUDGET_MB
+#define ALO_LOCK_BUDGET_MB 192
+#endif
+// loop memory is locked in chunks of this size until mlock() fails
+#define LOCK_CHUNK (1024 * 1024)
+
+// MIDI clock runs at 24 pulses per quarter note
+#define CLOCK_PPQN 24
+// DLL bandwidth relative to the tick rate, lower is smoother but slower
+#define CLOCK_BANDWIDTH 0.005
+// ticks further apart than this (in seconds) restart the estimator
+#define CLOCK_TIMEOUT 0.25
+// estimated tempo must move this far (in bpm) before loops are resized
+#define CLOCK_BPM_HYSTERESIS 0.5
+// ... and then stay within this much (in bpm) of one value
+#define CLOCK_BPM_TOLERANCE 0.2
+// ... for this many beats
+#define CLOCK_HOLD_BEATS 4
+
 #define HIGH_BEAT_FREQ 880
 #define LOW_BEAT_FREQ 440
 
@@ -149,6 +215,9 @@ typedef struct {
     float *mix;
     float *reset_mode;
     int *enabled;
+    float *quantize; // grid for loop transitions
+    float *ready;    // output: 1 once loop memory is resident
+    float *levels[NUM_LOOPS]; // playback gain per loop
     LV2_Atom_Sequence *control;
     LV2_Atom_Sequence *midiin; // midi input
   } ports;
@@ -161,6 +230,8 @@ typedef struct {
   float threshold;       // minimum level to trigger loop start
   uint32_t loop_beats;   // loop length in beats
   uint32_t loop_samples; // loop length in samples
+  uint32_t bars_beats;   // bars * beats per bar, before fitting in loop_size
+  bool free_running;     // no transport, the first loop sets the length
   uint32_t current_bb;   // which beat of the bar we are on (1, 2, 3, 0)
   uint32_t current_lb;   // which beat of the loop we are on (1, 2, ...)
   float current_position;
@@ -169,17 +240,32 @@ typedef struct {
 
   uint32_t pb_loops; // number of loops in instant mode
 
-  State state[NUM_LOOPS]; // we're recording, playing or not playing
+  int32_t num_loops; // number of loops in this instance
+  size_t loop_size;  // maximum loop length in samples
 
-  bool button_state[NUM_LOOPS];
+  // Per-loop state and all loop audio live in one mapping, see layout_arena()
+  char *arena;
+  size_t arena_size;
+  size_t audio_offset; // start of the loop audio within the arena
+  size_t lock_budget;  // bytes of loop audio to lock into RAM
+
+  State *state; // we're recording, playing or not playing
+
+  bool *button_state;
   bool midi_control;
-  uint32_t button_time[NUM_LOOPS]; // last time button was pressed
+  uint32_t *button_time; // last time button was pressed, per loop
+  uint32_t stop_time;    // last time the undo button was pressed
 
-  float *loops[NUM_LOOPS];          // pointers to memory for playing loops
-  uint32_t phrase_start[NUM_LOOPS]; // index into recording/loop
+  float **loops;          // pointers to memory for playing loops
+  uint32_t *phrase_start; // index into recording/loop
   float *recording;    // pointer to memory for recording - for all loops
   uint32_t loop_start; // non-zero for free-running loops
   uint32_t loop_index; // index into loop for current play point
+  uint64_t frame;      // frames processed since instantiation
+  uint64_t cycle_start; // frame at the start of the current cycle
+
+  Action actions[MAX_ACTIONS]; // pending quantized loop transitions
+  uint32_t num_actions;
 
   ClickState clickstate;
 
@@ -194,6 +280,25 @@ typedef struct {
   uint32_t low_beat_offset;
   float inmix;
   float loopmix;
+  float *gain;      // current playback gain per loop
+  float *gain_step; // per sample gain change over this cycle
+
+  // MIDI clock tempo estimator, a second order delay-locked loop
+  bool clock_active;     // MIDI clock overrides the host tempo and transport
+  uint32_t clock_ticks;  // ticks since the estimator was restarted
+  uint32_t clock_song;   // ticks since MIDI start
+  uint32_t clock_held;   // ticks the candidate tempo has held for
+  float clock_bpm;       // candidate tempo, not yet applied
+  double clock_time;     // filtered time of the last tick, in frames
+  double clock_next;     // predicted time of the next tick, in frames
+  double clock_period;   // filtered frames per tick
+  uint64_t clock_last;   // frame of the last clock or transport message
+
+  // Background prefault of loop memory
+  pthread_t prefault_thread;
+  bool prefault_started;
+  bool ready; // set by the prefault thread, read in run()
+  bool quit;  // set by cleanup() to stop the prefault thread early
 } Alo;
 
 void sine_pulse(float *target, double frequency, double sample_rate,
@@ -214,12 +319,190 @@ void sine_pulse(float *target, double frequency, double sample_rate,
   }
 }
 
+static void *arena_take(char *arena, uint64_t *offset, uint64_t bytes) {
+  void *const part = arena ? arena + *offset : NULL;
+  *offset += (bytes + CACHE_LINE - 1) & ~(uint64_t)(CACHE_LINE - 1);
+  return part;
+}
+
+/**
+   Carve the per-loop state and the loop audio out of `arena`, each part
+   starting on its own cache line, and return the total size.  With a NULL
+   arena only the size is computed.  Sizes are 64 bit so that oversized
+   configurations can be caught before mapping on 32 bit targets.
+*/
+static uint64_t layout_arena(Alo *self, char *arena) {
+  const uint64_t n = self->num_loops;
+  const uint64_t audio = (uint64_t)self->loop_size * 2 * sizeof(float);
+  uint64_t offset = 0;
+
+  self->state = (State *)arena_take(arena, &offset, n * sizeof(State));
+  self->phrase_start =
+      (uint32_t *)arena_take(arena, &offset, n * sizeof(uint32_t));
+  self->button_state = (bool *)arena_take(arena, &offset, n * sizeof(bool));
+  self->button_time =
+      (uint32_t *)arena_take(arena, &offset, n * sizeof(uint32_t));
+  self->gain = (float *)arena_take(arena, &offset, n * sizeof(float));
+  self->gain_step = (float *)arena_take(arena, &offset, n * sizeof(float));
+  self->loops = (float **)arena_take(arena, &offset, n * sizeof(float *));
+
+  self->audio_offset = (size_t)offset;
+  self->recording = (float *)arena_take(arena, &offset, audio);
+  for (uint64_t i = 0; i < n; i++) {
+    float *const loop = (float *)arena_take(arena, &offset, audio);
+    if (arena) {
+      self->loops[i] = loop;
+    }
+  }
+  return offset;
+}
+
+/**
+   Map the zeroed arena.  Pages are only backed on first touch, so this
+   returns immediately regardless of size.  The loop length is cut down
+   first if the arena would not fit in ALO_MAX_LOOP_MEMORY_MB.
+*/
+static bool map_arena(Alo *self) {
+  const uint64_t max_size = (uint64_t)ALO_MAX_LOOP_MEMORY_MB * 1024 * 1024;
+  uint64_t size = layout_arena(self, NULL);
+  if (size > max_size) {
+    // one spare cache line of samples per buffer covers the alignment
+    const uint64_t buffers = self->num_loops + 1;
+    const uint64_t samples = (max_size - self->audio_offset) /
+                             (buffers * 2 * sizeof(float));
+    self->loop_size = (size_t)(samples - CACHE_LINE);
+    size = layout_arena(self, NULL);
+    log("Loop length cut to %d samples to fit memory", (int)self->loop_size);
+  }
+  if (size > max_size || size > SIZE_MAX) {
+    self->arena = NULL;
+    return false;
+  }
+
+  self->arena_size = (size_t)size;
+  void *arena = mmap(NULL, self->arena_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED) {
+    self->arena = NULL;
+    return false;
+  }
+  self->arena = (char *)arena;
+  layout_arena(self, self->arena);
+  return true;
+}
+
+static void unmap_arena(Alo *self) {
+  if (self->arena) {
+    munmap(self->arena, self->arena_size);
+  }
+}
+
+/**
+   Touch every page of a buffer so the audio thread never takes a page fault
+   on it, then lock as much of it as the budget and RLIMIT_MEMLOCK allow.
+   Locking goes chunk by chunk, so hitting the limit still leaves the start
+   of the buffer locked.
+*/
+static void prefault_buffer(Alo *self, char *buffer, size_t bytes,
+                            size_t budget) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  volatile char *const data = buffer;
+
+  for (size_t offset = 0; offset < bytes; offset += page) {
+    if (__atomic_load_n(&self->quit, __ATOMIC_RELAXED)) {
+      return;
+    }
+    data[offset] = 0;
+  }
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < budget) {
+    budget = limit.rlim_cur;
+  }
+  if (budget > bytes) {
+    budget = bytes;
+  }
+
+  size_t locked = 0;
+  while (locked < budget) {
+    if (__atomic_load_n(&self->quit, __ATOMIC_RELAXED)) {
+      return;
+    }
+    const size_t chunk =
+        budget - locked < LOCK_CHUNK ? budget - locked : LOCK_CHUNK;
+    if (mlock(buffer + locked, chunk) != 0) {
+      break;
+    }
+    locked += chunk;
+  }
+  log("Locked %d of %d bytes of loop memory", (int)locked, (int)bytes);
+}
+
+/**
+   Prefault thread body.  The per-loop state is already resident, so only the
+   loop audio is faulted in.  The recording buffer is laid out first as it is
+   written from the very first cycle, followed by the loops in the order they
+   are used.
+*/
+static void *prefault(void *instance) {
+  Alo *self = (Alo *)instance;
+
+  prefault_buffer(self, self->arena + self->audio_offset,
+                  self->arena_size - self->audio_offset, self->lock_budget);
+
+  __atomic_store_n(&self->ready, true, __ATOMIC_RELEASE);
+  log("Loop memory ready");
+  return NULL;
+}
+
+static bool loops_ready(Alo *self) {
+  return __atomic_load_n(&self->ready, __ATOMIC_ACQUIRE);
+}
+
+/**
+   Read the loop count and length from the host options, if any.
+*/
+static void read_options(Alo *self, const LV2_Options_Option *options) {
+  for (; options && options->key; options++) {
+    if (options->context != LV2_OPTIONS_INSTANCE) {
+      continue;
+    }
+
+    float value;
+    if (options->type == self->uris.atom_Int) {
+      value = (float)*(const int32_t *)options->value;
+    } else if (options->type == self->uris.atom_Float) {
+      value = *(const float *)options->value;
+    } else {
+      continue;
+    }
+
+    if (options->key == self->uris.alo_numLoops) {
+      self->num_loops = (int32_t)fminf(fmaxf(value, 1.0f), NUM_LOOPS);
+    } else if (options->key == self->uris.alo_loopLength) {
+      value = fminf(fmaxf(value, 1.0f), MAX_LOOP_LENGTH);
+      self->loop_size = (size_t)(value * self->rate);
+    } else if (options->key == self->uris.alo_lockBudget) {
+      value = fminf(fmaxf(value, 0.0f), 4095.0f);
+      self->lock_budget = (size_t)value * 1024 * 1024;
+    }
+  }
+  log("Loops: %d x %d samples", self->num_loops, (int)self->loop_size);
+}
+
 /**
    The `instantiate()` function is called by the host to create a new plugin
    instance.  The host passes the plugin descriptor, sample rate, and bundle
    path for plugins that need to load additional resources (e.g. waveforms).
    The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   extensions.  This plugin requires urid:map and reads the numLoops,
+   loopLength and lockBudget options from opts:options when the host
+   provides them.
+
+   Loop memory is mapped lazily here, sized by the numLoops and loopLength
+   options, and made resident by a background thread, which locks up to
+   lockBudget of it and sets `ready` when done.
 
    This function is in the ``instantiation'' threading class, so no other
    methods on this instance will be called concurrently with it.
@@ -233,6 +516,8 @@ static LV2_Handle instantiate(const LV2_Descriptor *descriptor, double rate,
   self->rate = rate;
   self->bpb = DEFAULT_BEATS_PER_BAR;
   self->loop_beats = DEFAULT_BEATS_PER_BAR * DEFAULT_NUM_BARS;
+  self->bars_beats = self->loop_beats;
+  self->free_running = true;
   self->bpm = DEFAULT_BPM;
   self->loop_samples = self->loop_beats * self->rate * 60.0f / self->bpm;
   self->current_bb = 0;
@@ -244,21 +529,28 @@ static LV2_Handle instantiate(const LV2_Descriptor *descriptor, double rate,
 
   self->midi_control = false;
 
-  self->recording = (float *)calloc(LOOP_SIZE * 2, sizeof(float));
+  self->num_loops = NUM_LOOPS;
+  self->loop_size = DEFAULT_LOOP_SIZE;
+  self->lock_budget = (size_t)ALO_LOCK_BUDGET_MB * 1024 * 1024;
 
-  for (int i = 0; i < NUM_LOOPS; i++) {
-    self->loops[i] = (float *)calloc(LOOP_SIZE * 2, sizeof(float));
-    self->phrase_start[i] = 0;
-    self->state[i] = STATE_RECORDING;
-  }
   self->loop_start = 0;
   self->loop_index = 0;
+  self->frame = 0;
+  self->num_actions = 0;
+  self->clock_active = false;
+  self->clock_ticks = 0;
+  self->clock_song = 0;
+  self->clock_held = 0;
+  self->clock_last = 0;
   self->threshold = 0.0;
 
   LV2_URID_Map *map = NULL;
+  const LV2_Options_Option *options = NULL;
   for (int i = 0; features[i]; ++i) {
     if (!strcmp(features[i]->URI, LV2_URID_URI "#map")) {
       map = (LV2_URID_Map *)features[i]->data;
+    } else if (!strcmp(features[i]->URI, LV2_OPTIONS__options)) {
+      options = (const LV2_Options_Option *)features[i]->data;
     }
   }
   if (!map) {
@@ -272,6 +564,7 @@ static LV2_Handle instantiate(const LV2_Descriptor *descriptor, double rate,
   self->map = map;
   uris->atom_Blank = map->map(map->handle, LV2_ATOM__Blank);
   uris->atom_Float = map->map(map->handle, LV2_ATOM__Float);
+  uris->atom_Int = map->map(map->handle, LV2_ATOM__Int);
   uris->atom_Object = map->map(map->handle, LV2_ATOM__Object);
   uris->atom_Path = map->map(map->handle, LV2_ATOM__Path);
   uris->atom_Resource = map->map(map->handle, LV2_ATOM__Resource);
@@ -282,6 +575,25 @@ static LV2_Handle instantiate(const LV2_Descriptor *descriptor, double rate,
   uris->time_speed = map->map(map->handle, LV2_TIME__speed);
   uris->time_beatsPerBar = map->map(map->handle, LV2_TIME__beatsPerBar);
   uris->midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+  uris->alo_numLoops = map->map(map->handle, ALO__numLoops);
+  uris->alo_loopLength = map->map(map->handle, ALO__loopLength);
+  uris->alo_lockBudget = map->map(map->handle, ALO__lockBudget);
+
+  read_options(self, options);
+  if (!map_arena(self)) {
+    fprintf(stderr, "Could not map loop memory.\n");
+    free(self);
+    return NULL;
+  }
+  if (self->loop_samples > self->loop_size) {
+    self->loop_samples = self->loop_size;
+  }
+  for (int i = 0; i < self->num_loops; i++) {
+    self->phrase_start[i] = 0;
+    self->state[i] = STATE_RECORDING;
+    self->gain[i] = 1.0f;
+    self->gain_step[i] = 0.0f;
+  }
 
   // Generate pulses for the metronome
   self->beat_len = (uint32_t)(0.02f * self->rate);
@@ -292,6 +604,15 @@ static LV2_Handle instantiate(const LV2_Descriptor *descriptor, double rate,
   self->high_beat_offset = self->beat_len;
   self->low_beat_offset = self->beat_len;
 
+  self->ready = false;
+  self->quit = false;
+  self->prefault_started =
+      pthread_create(&self->prefault_thread, NULL, prefault, self) == 0;
+  if (!self->prefault_started) {
+    // No thread, fall back to faulting pages in from run()
+    self->ready = true;
+  }
+
   return (LV2_Handle)self;
 }
 
@@ -364,6 +685,23 @@ static void connect_port(LV2_Handle instance, uint32_t port, void *data) {
     self->ports.enabled = (int *)data;
     log("Connect ALO_ENABLED %d", port);
     break;
+  case ALO_QUANTIZE:
+    self->ports.quantize = (float *)data;
+    log("Connect ALO_QUANTIZE %d", port);
+    break;
+  case ALO_READY:
+    self->ports.ready = (float *)data;
+    log("Connect ALO_READY %d", port);
+    break;
+  case ALO_LEVEL1:
+  case ALO_LEVEL2:
+  case ALO_LEVEL3:
+  case ALO_LEVEL4:
+  case ALO_LEVEL5:
+  case ALO_LEVEL6:
+    self->ports.levels[port - ALO_LEVEL1] = (float *)data;
+    log("Connect ALO_LEVEL %d", port - ALO_LEVEL1);
+    break;
   default:
     int loop = port - 4;
     self->ports.loops[loop] = (float *)data;
@@ -372,22 +710,55 @@ static void connect_port(LV2_Handle instance, uint32_t port, void *data) {
   log("Connect end");
 }
 
+/**
+   Loop length in beats as asked for by the bars port and the host.
+*/
+static uint32_t bars_beats(const Alo *self) {
+  return (uint32_t)fmaxf(floorf(self->bpb), 1.0f) *
+         (uint32_t)fmaxf(floorf(*(self->ports.bars)), 1.0f);
+}
+
+/**
+   Recompute the loop length in samples from the tempo and bar count.  In
+   sync mode, bars that do not fit in loop_size are dropped, and a single
+   bar longer than loop_size is cut short.  Without transport the loop is
+   free running and its length is set later by button_logic().
+*/
+static void update_loop_samples(Alo *self) {
+  const uint32_t bpb = (uint32_t)fmaxf(floorf(self->bpb), 1.0f);
+  const uint32_t bars = (uint32_t)fmaxf(floorf(*(self->ports.bars)), 1.0f);
+  const double beat_samples = self->rate * 60.0 / self->bpm;
+
+  self->bars_beats = bars_beats(self);
+  self->free_running = self->speed == 0;
+  if (self->free_running) {
+    self->loop_beats = self->bars_beats;
+    self->loop_samples = self->loop_size;
+    return;
+  }
+
+  uint32_t fit = (uint32_t)(self->loop_size / (beat_samples * bpb));
+  if (fit < 1) {
+    fit = 1;
+  }
+  self->loop_beats = bpb * (bars < fit ? bars : fit);
+  self->loop_samples = self->loop_beats * beat_samples;
+  if (self->loop_samples > self->loop_size) {
+    self->loop_samples = self->loop_size;
+  }
+}
+
 static void reset(Alo *self) {
   log("Reset");
   self->pb_loops = (uint32_t)floorf(*(self->ports.pb_loops));
-  self->loop_beats =
-      (uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars));
-  self->loop_samples = self->loop_beats * self->rate * 60.0f / self->bpm;
-
-  if (self->loop_samples > LOOP_SIZE || self->speed == 0) {
-    self->loop_samples = LOOP_SIZE;
-  }
+  update_loop_samples(self);
   self->loop_index = 0;
   self->loop_start = 0;
+  self->num_actions = 0;
   log("Loop beats: %d", self->loop_beats);
   log("BPM: %G", self->bpm);
   log("Loop_samples: %d", self->loop_samples);
-  for (int i = 0; i < NUM_LOOPS; i++) {
+  for (int i = 0; i < self->num_loops; i++) {
     self->button_state[i] = (*self->ports.loops[i]) > 0.0f ? true : false;
     self->state[i] = STATE_RECORDING;
     self->phrase_start[i] = 0;
@@ -427,11 +798,15 @@ static void update_position(Alo *self, const LV2_Atom_Object *obj) {
     }
   }
 
-  if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) !=
-      self->loop_beats) {
+  if (bars_beats(self) != self->bars_beats) {
     reset(self);
   }
 
+  if (self->clock_active) {
+    // MIDI clock is driving tempo and transport
+    return;
+  }
+
   if (bpm && bpm->type == uris->atom_Float) {
     if (round(self->bpm) != round(((LV2_Atom_Float *)bpm)->body)) {
       // Tempo changed, update BPM
@@ -440,8 +815,7 @@ static void update_position(Alo *self, const LV2_Atom_Object *obj) {
     }
   }
 
-  if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) !=
-      self->loop_beats) {
+  if (bars_beats(self) != self->bars_beats) {
     reset(self);
   }
 
@@ -472,7 +846,96 @@ static void update_position(Alo *self, const LV2_Atom_Object *obj) {
 }
 
 /**
-   WIP - button 0 records/overdubs up to NUM_LOOPS , button 1 undo/clears
+   Number of frames from now until the next boundary of the quantize grid, or
+   0 if the transition should happen immediately.  The grid is measured from
+   loop_start, so it only makes sense once the loop length is known.
+*/
+static uint32_t quantize_offset(Alo *self) {
+  const Quantize quantize = (Quantize)(uint32_t)floorf(*(self->ports.quantize));
+  if (quantize == QUANTIZE_OFF || self->free_running ||
+      self->loop_samples == 0) {
+    return 0;
+  }
+
+  uint32_t grid = self->loop_samples;
+  if (quantize != QUANTIZE_LOOP && self->loop_beats > 0) {
+    const uint32_t beat_samples = self->loop_samples / self->loop_beats;
+    grid = quantize == QUANTIZE_BAR
+               ? beat_samples * (uint32_t)floorf(self->bpb)
+               : beat_samples;
+  }
+  if (grid == 0 || grid > self->loop_samples) {
+    grid = self->loop_samples;
+  }
+
+  const uint32_t position = (self->loop_index - self->loop_start) % grid;
+  return position == 0 ? 0 : grid - position;
+}
+
+/**
+   Move loop i into a new state, either right away or at the next quantize
+   boundary.  A later request for the same loop replaces any pending one.
+*/
+static void schedule_state(Alo *self, int32_t i, State state) {
+  for (uint32_t a = 0; a < self->num_actions; a++) {
+    if (self->actions[a].loop == i) {
+      self->actions[a] = self->actions[--self->num_actions];
+      break;
+    }
+  }
+
+  const uint32_t offset = quantize_offset(self);
+  if (offset == 0 || self->num_actions == (uint32_t)MAX_ACTIONS) {
+    self->state[i] = state;
+    if (state == STATE_RECORDING) {
+      self->phrase_start[i] = self->loop_index;
+    }
+    return;
+  }
+
+  Action *const action = &self->actions[self->num_actions++];
+  action->time = self->frame + offset;
+  action->loop = i;
+  action->state = state;
+  log("[Looper %d] state %d scheduled in %d frames", i, state, offset);
+}
+
+/**
+   Apply every pending action that is due at the current frame.
+*/
+static void apply_actions(Alo *self) {
+  uint32_t a = 0;
+  while (a < self->num_actions) {
+    const Action action = self->actions[a];
+    if (action.time > self->frame) {
+      a++;
+      continue;
+    }
+    self->state[action.loop] = action.state;
+    if (action.state == STATE_RECORDING) {
+      self->phrase_start[action.loop] = self->loop_index;
+    }
+    self->actions[a] = self->actions[--self->num_actions];
+    log("[Looper %d] state %d applied at [%d]", action.loop, action.state,
+        self->loop_index);
+  }
+}
+
+/**
+   Frame of the earliest pending action, or UINT64_MAX if there is none.
+*/
+static uint64_t next_action_time(const Alo *self) {
+  uint64_t next = UINT64_MAX;
+  for (uint32_t a = 0; a < self->num_actions; a++) {
+    if (self->actions[a].time < next) {
+      next = self->actions[a].time;
+    }
+  }
+  return next;
+}
+
+/**
+   WIP - button 0 records/overdubs up to num_loops , button 1 undo/clears
 */
 
 static void button_logic(LV2_Handle instance, bool btn_state, int i) {
@@ -488,7 +951,7 @@ static void button_logic(LV2_Handle instance, bool btn_state, int i) {
   const int stop_button_index = 1;
   const int record_button_index = 0;
 
-  int difference = milliseconds - self->button_time[stop_button_index];
+  int difference = milliseconds - self->stop_time;
 
   // --- Record button logic ---
   if (i == record_button_index) {
@@ -498,7 +961,7 @@ static void button_logic(LV2_Handle instance, bool btn_state, int i) {
       last_record_state = true;
       log("[[ Recording into %d ]]", self->current_loop);
     } else if (!btn_state && last_record_state) {
-      self->state[self->current_loop] = STATE_LOOP_ON;
+      schedule_state(self, self->current_loop, STATE_LOOP_ON);
       self->current_loop++;
       last_record_state = false;
       log(" -->>  Moving to loop %d -----", self->current_loop);
@@ -512,20 +975,18 @@ static void button_logic(LV2_Handle instance, bool btn_state, int i) {
 
       // Only undo if not already at loop 0
       if (self->current_loop > 0) {
-        self->phrase_start[self->current_loop] = self->loop_index;
         self->button_state[self->current_loop] = false;
-        self->state[self->current_loop] = STATE_RECORDING;
+        schedule_state(self, self->current_loop, STATE_RECORDING);
         log("[[   UNDOING LOOP %d   ]]", self->current_loop);
         self->current_loop--;
       } else {
         self->current_loop = 0;
-        self->phrase_start[0] = self->loop_index;
         self->button_state[0] = false;
-        self->state[0] = STATE_RECORDING;
+        schedule_state(self, 0, STATE_RECORDING);
         log("Loop 0 rearmed for recording");
       }
 
-      self->button_time[stop_button_index] = milliseconds;
+      self->stop_time = milliseconds;
     } else if (!btn_state && last_stop_state) {
       last_stop_state = false;
 
@@ -540,17 +1001,17 @@ static void button_logic(LV2_Handle instance, bool btn_state, int i) {
   // --- Loop bounds enforcement ---
   if (self->current_loop < 0) {
     self->current_loop = 0;
-  } else if (self->current_loop >= NUM_LOOPS) {
-    self->current_loop = NUM_LOOPS - 1;
+  } else if (self->current_loop >= self->num_loops) {
+    self->current_loop = self->num_loops - 1;
   }
 
-  // --- Free running mode ---
-  if (self->loop_samples == LOOP_SIZE) {
-    for (int j = 0; j < NUM_LOOPS; j++) {
+  // --- Free running mode, the first loop sets the length ---
+  if (self->free_running && self->loop_samples == self->loop_size) {
+    for (int j = 0; j < self->num_loops; j++) {
       if (self->phrase_start[j] != 0) {
         self->loop_samples =
-            LOOP_SIZE + self->loop_index - self->phrase_start[j];
-        self->loop_samples = self->loop_samples % LOOP_SIZE;
+            self->loop_size + self->loop_index - self->phrase_start[j];
+        self->loop_samples = self->loop_samples % self->loop_size;
         self->loop_start = self->phrase_start[j];
       }
     }
@@ -594,7 +1055,7 @@ static void run_clicks(Alo *self, uint32_t n_samples) {
   self->current_position = fmodf(self->current_position, self->bpb);
   const float beat = floorf(self->current_position);
 
-  for (uint32_t i = 0; i < NUM_LOOPS; i++) {
+  for (int i = 0; i < self->num_loops; i++) {
     if (self->state[i] == STATE_LOOP_ON) {
       play_click = false;
     }
@@ -620,36 +1081,193 @@ static void run_clicks(Alo *self, uint32_t n_samples) {
   }
 }
 
-static void run_events(Alo *self) {
-  const LV2_Atom_Sequence *midiin = self->ports.midiin;
+static uint32_t clock_bar_ticks(const Alo *self) {
+  return CLOCK_PPQN * (uint32_t)fmaxf(floorf(self->bpb), 1.0f);
+}
 
-  for (const LV2_Atom_Event *ev = lv2_atom_sequence_begin(&midiin->body);
-       !lv2_atom_sequence_is_end(&midiin->body, midiin->atom.size, ev);
+/**
+   Apply a new MIDI clock tempo.  Only the loop length changes, the loops are
+   kept and the play point is moved to where the clock says it should be.
+*/
+static void clock_tempo(Alo *self, float bpm) {
+  self->bpm = bpm;
+  update_loop_samples(self);
+  log("MIDI clock tempo: %G", self->bpm);
+
+  const uint32_t loop_ticks = self->loop_beats * CLOCK_PPQN;
+  if (self->free_running || loop_ticks == 0) {
+    self->loop_index = self->loop_start;
+    return;
+  }
+  const uint64_t ticks = self->clock_song % loop_ticks;
+  self->loop_index =
+      self->loop_start + (uint32_t)(ticks * self->loop_samples / loop_ticks);
+}
 
-       ev = lv2_atom_sequence_next(ev)) {
+/**
+   Feed one MIDI clock tick at absolute frame `frame` into the tempo
+   estimator.  The first beat of ticks sets the initial period, after that a
+   narrow delay-locked loop follows it.  A new tempo is only applied once it
+   has moved more than CLOCK_BPM_HYSTERESIS away from the current one and
+   then held within CLOCK_BPM_TOLERANCE for CLOCK_HOLD_BEATS beats.
+*/
+static void clock_tick(Alo *self, uint64_t frame) {
+  const double timeout = CLOCK_TIMEOUT * self->rate;
+  const double time = (double)frame;
 
-    if (ev->body.type == self->uris.midi_MidiEvent) {
-      const uint8_t *const msg = (const uint8_t *)(ev + 1);
-      int i = msg[1] - (uint32_t)floorf(*(self->ports.midi_base));
-      if (i >= 0 && i < NUM_LOOPS) {
-        if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_ON) {
-          button_logic(self, true, i);
-        }
-        if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_OFF) {
-          button_logic(self, false, i);
-        }
-        self->midi_control = true;
-      }
+  self->clock_active = true;
+  if (self->clock_ticks > 0 && frame - self->clock_last > timeout) {
+    self->clock_ticks = 0;
+  }
+  self->clock_last = frame;
+
+  if (self->clock_ticks == 0) {
+    self->clock_time = time;
+    self->clock_held = 0;
+  } else if (self->clock_ticks == CLOCK_PPQN) {
+    self->clock_period = (time - self->clock_time) / CLOCK_PPQN;
+    self->clock_time = time;
+    self->clock_next = time + self->clock_period;
+  } else if (self->clock_ticks > CLOCK_PPQN) {
+    const double omega = 2 * M_PI * CLOCK_BANDWIDTH;
+    const double error = time - self->clock_next;
+    self->clock_time = self->clock_next;
+    self->clock_next += sqrt(2) * omega * error + self->clock_period;
+    self->clock_period += omega * omega * error;
+  }
+  self->clock_ticks++;
+
+  if (self->speed) {
+    self->clock_song++;
+  }
+
+  if (self->clock_ticks <= CLOCK_PPQN || self->clock_period <= 0) {
+    return;
+  }
+
+  const float bpm = self->rate * 60.0 / (self->clock_period * CLOCK_PPQN);
+  if (fabsf(bpm - self->bpm) <= CLOCK_BPM_HYSTERESIS) {
+    self->clock_held = 0;
+  } else if (self->clock_held == 0 ||
+             fabsf(bpm - self->clock_bpm) > CLOCK_BPM_TOLERANCE) {
+    self->clock_bpm = bpm;
+    self->clock_held = 1;
+  } else if (++self->clock_held >= CLOCK_HOLD_BEATS * CLOCK_PPQN) {
+    self->clock_held = 0;
+    clock_tempo(self, bpm);
+  }
+
+  // Bar position at the start of this cycle, for the click
+  const double elapsed =
+      ((double)self->cycle_start - self->clock_time) / self->clock_period;
+  self->current_position =
+      (self->clock_song % clock_bar_ticks(self) + elapsed) / CLOCK_PPQN;
+}
+
+/**
+   Handle MIDI start, continue and stop like a host transport speed change.
+   This is called from run_loops() at the frame of the message, so on start
+   the loop is re-phased to begin exactly there.
+*/
+static void clock_transport(Alo *self, float speed, bool rewind) {
+  self->clock_active = true;
+  self->clock_last = self->frame;
+  if (self->speed != speed) {
+    self->speed = speed;
+    reset(self);
+    log("MIDI clock speed change: %G", self->speed);
+  }
+  if (!rewind) {
+    return;
+  }
+
+  // the first tick after a start is the downbeat (tick 0), the click
+  // position is kept relative to the start of the cycle like the host one
+  const double since_cycle = (double)(self->frame - self->cycle_start);
+  self->clock_song = UINT32_MAX;
+  self->current_position = -since_cycle / self->rate / 60.0f * self->bpm;
+  self->current_bb = 0;
+  self->current_lb = 0;
+  self->loop_index = self->loop_start;
+
+  // pending transitions were placed on the old grid
+  const uint32_t quantize = quantize_offset(self);
+  for (uint32_t a = 0; a < self->num_actions; a++) {
+    self->actions[a].time = self->frame + quantize;
+  }
+  log("MIDI start, loop index [%d]", self->loop_index);
+}
+
+/**
+   Give tempo and transport back to the host once MIDI clock has gone quiet.
+*/
+static void clock_timeout(Alo *self) {
+  if (self->clock_active &&
+      self->frame - self->clock_last > CLOCK_TIMEOUT * self->rate) {
+    self->clock_active = false;
+    self->clock_ticks = 0;
+    log("MIDI clock lost, following host tempo");
+  }
+}
+
+/**
+   Handle one event from the MIDI input.  This is called from run_loops() once
+   the cycle has been processed up to the frame of the event, so loop state
+   changes and quantize offsets are measured from the event itself.
+*/
+static void run_midi_event(Alo *self, const LV2_Atom_Event *ev) {
+  if (ev->body.type != self->uris.midi_MidiEvent) {
+    return;
+  }
+  const uint8_t *const msg = (const uint8_t *)(ev + 1);
+
+  // System real-time messages are a single byte
+  switch (msg[0]) {
+  case LV2_MIDI_MSG_CLOCK:
+    clock_tick(self, self->frame);
+    return;
+  case LV2_MIDI_MSG_START:
+    clock_transport(self, 1.0f, true);
+    return;
+  case LV2_MIDI_MSG_CONTINUE:
+    clock_transport(self, 1.0f, false);
+    return;
+  case LV2_MIDI_MSG_STOP:
+    clock_transport(self, 0.0f, false);
+    return;
+  default:
+    break;
+  }
+  if (ev->body.size < 2) {
+    return;
+  }
+
+  int i = msg[1] - (uint32_t)floorf(*(self->ports.midi_base));
+  if (i >= 0 && i < NUM_LOOPS && loops_ready(self)) {
+    if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_ON) {
+      button_logic(self, true, i);
+    }
+    if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_OFF) {
+      button_logic(self, false, i);
     }
+    self->midi_control = true;
   }
+}
 
-  if (self->midi_control == false) {
+/**
+   Poll the loop switches.  Control ports have no time within the cycle, so
+   this is done at the start of the cycle.
+*/
+static void run_buttons(Alo *self) {
+  if (self->midi_control == false && loops_ready(self)) {
     for (int i = 0; i < NUM_LOOPS; i++) {
       bool new_button_state = (*self->ports.loops[i]) > 0.0f ? true : false;
       button_logic(self, new_button_state, i);
     }
   }
+}
 
+static void run_events(Alo *self) {
   const AloURIs *uris = &self->uris;
 
   // from metro.c
@@ -674,47 +1292,170 @@ static void run_events(Alo *self) {
   }
 }
 
-static void run_loops(Alo *self, uint32_t n_samples) {
+/**
+   Add `gain * in` to `out`, with the gain moving linearly by `step` per
+   sample.  Kept free of branches so the compiler can vectorize it.
+*/
+static void mix_ramp(float *out, const float *in, uint32_t n, float gain,
+                     float step) {
+  for (uint32_t k = 0; k < n; ++k) {
+    out[k] += (gain + step * k) * in[k];
+  }
+}
+
+/**
+   Record and play the loops for the range [begin..end) of this cycle.  Loop
+   states are constant over the range.  The range is handled in runs that do
+   not cross the loop wrap, so each run is a straight copy or mix.  Loops are
+   stored unscaled, the loop level and mix are applied here on playback.
+*/
+static void run_loops_range(Alo *self, uint32_t begin, uint32_t end) {
   const float *const input_l = self->ports.input_l;
   const float *const input_r = self->ports.input_r;
   float *const output_l = self->ports.output_l;
   float *const output_r = self->ports.output_r;
   float *const recording = self->recording;
-  self->threshold = dbToFloat(*self->ports.threshold);
 
-  self->loopmix = fmin(1.0, *self->ports.mix / 50);
-  self->inmix = fmin(1, (100 - *self->ports.mix) / 50);
+  uint32_t pos = begin;
+  while (pos < end) {
+    uint32_t loop_end = self->loop_start + self->loop_samples;
+    if (loop_end > self->loop_size) {
+      loop_end = self->loop_size;
+    }
+    if (self->loop_index >= loop_end) {
+      self->loop_index = self->loop_start;
+    }
+
+    const uint32_t index = self->loop_index;
+    uint32_t n = end - pos;
+    if (n > loop_end - index) {
+      n = loop_end - index;
+    }
+    if (n == 0) {
+      // zero length free running loop, step one sample at a time
+      n = 1;
+    }
 
-  for (uint32_t pos = 0; pos < n_samples; ++pos) {
-    float sample_l = input_l[pos];
-    float sample_r = input_r[pos];
-    output_l[pos] = self->inmix * sample_l;
-    output_r[pos] = self->inmix * sample_r;
-    recording[self->loop_index] = sample_l;
-    recording[self->loop_index + LOOP_SIZE] = sample_r;
+    // The host may hand us the same buffer for input and output, so all
+    // reads of the input happen before the output is written
+    memcpy(&recording[index], &input_l[pos], n * sizeof(float));
+    memcpy(&recording[index + self->loop_size], &input_r[pos],
+           n * sizeof(float));
 
-    for (uint32_t i = 0; i < NUM_LOOPS; ++i) {
+    for (int i = 0; i < self->num_loops; ++i) {
       float *const loop = self->loops[i];
-      if (self->state[i] == STATE_LOOP_ON) {
-        output_l[pos] += loop[self->loop_index];
-        output_r[pos] += loop[self->loop_index + LOOP_SIZE];
-      }
       if (self->state[i] == STATE_RECORDING) {
-        loop[self->loop_index] = self->loopmix * sample_l;
-        loop[self->loop_index + LOOP_SIZE] = self->loopmix * sample_r;
-        if (self->phrase_start[i] == 0 && (fabs(sample_l) > self->threshold ||
-                                           fabs(sample_r) > self->threshold)) {
-          self->phrase_start[i] = self->loop_index;
-          log("[Looper %d] DETECTED PHRASE START [%d]", i, self->loop_index);
+        memcpy(&loop[index], &input_l[pos], n * sizeof(float));
+        memcpy(&loop[index + self->loop_size], &input_r[pos],
+               n * sizeof(float));
+        for (uint32_t k = 0; self->phrase_start[i] == 0 && k < n; ++k) {
+          if (fabs(input_l[pos + k]) > self->threshold ||
+              fabs(input_r[pos + k]) > self->threshold) {
+            self->phrase_start[i] = index + k;
+            log("[Looper %d] DETECTED PHRASE START [%d]", i, index + k);
+          }
         }
       }
     }
 
-    self->loop_index++;
-    if (self->loop_index >= self->loop_start + self->loop_samples) {
+    for (uint32_t k = 0; k < n; ++k) {
+      output_l[pos + k] = self->inmix * input_l[pos + k];
+      output_r[pos + k] = self->inmix * input_r[pos + k];
+    }
+
+    for (int i = 0; i < self->num_loops; ++i) {
+      const float *const loop = self->loops[i];
+      if (self->state[i] == STATE_LOOP_ON &&
+          (self->gain[i] != 0.0f || self->gain_step[i] != 0.0f)) {
+        mix_ramp(&output_l[pos], &loop[index], n, self->gain[i],
+                 self->gain_step[i]);
+        mix_ramp(&output_r[pos], &loop[index + self->loop_size], n,
+                 self->gain[i], self->gain_step[i]);
+      }
+      self->gain[i] += self->gain_step[i] * n;
+    }
+
+    pos += n;
+    self->loop_index += n;
+    if (self->loop_index >= loop_end) {
       self->loop_index = self->loop_start;
     }
   }
+  self->frame += end - begin;
+}
+
+/**
+   Pass the input straight through for the range [begin..end) while loop
+   memory is not ready yet.
+*/
+static void run_through_range(Alo *self, uint32_t begin, uint32_t end) {
+  for (uint32_t pos = begin; pos < end; ++pos) {
+    self->ports.output_l[pos] = self->ports.input_l[pos];
+    self->ports.output_r[pos] = self->ports.input_r[pos];
+  }
+  self->frame += end - begin;
+}
+
+/**
+   Split the cycle at the MIDI input events and at the times of pending
+   quantized actions, so that every event is handled at its own frame and
+   every loop transition lands on its exact sample.
+*/
+static void run_loops(Alo *self, uint32_t n_samples) {
+  const LV2_Atom_Sequence *midiin = self->ports.midiin;
+  const LV2_Atom_Event *ev = lv2_atom_sequence_begin(&midiin->body);
+  const bool ready = loops_ready(self);
+
+  self->cycle_start = self->frame;
+  run_buttons(self);
+
+  self->threshold = dbToFloat(*self->ports.threshold);
+
+  self->loopmix = fmin(1.0, *self->ports.mix / 50);
+  self->inmix = fmin(1, (100 - *self->ports.mix) / 50);
+
+  // Ramp each loop level to its new target over the cycle
+  float target[NUM_LOOPS];
+  for (int i = 0; i < self->num_loops; i++) {
+    target[i] = self->loopmix * *self->ports.levels[i];
+    self->gain_step[i] =
+        n_samples ? (target[i] - self->gain[i]) / n_samples : 0.0f;
+  }
+
+  uint32_t begin = 0;
+  for (;;) {
+    while (!lv2_atom_sequence_is_end(&midiin->body, midiin->atom.size, ev) &&
+           (ev->time.frames <= begin || begin == n_samples)) {
+      run_midi_event(self, ev);
+      ev = lv2_atom_sequence_next(ev);
+    }
+    apply_actions(self);
+    if (begin == n_samples) {
+      break;
+    }
+
+    uint32_t end = n_samples;
+    if (!lv2_atom_sequence_is_end(&midiin->body, midiin->atom.size, ev) &&
+        ev->time.frames < end) {
+      end = (uint32_t)ev->time.frames;
+    }
+    const uint64_t next = next_action_time(self);
+    if (next < self->frame + (end - begin)) {
+      end = begin + (uint32_t)(next - self->frame);
+    }
+
+    if (ready) {
+      run_loops_range(self, begin, end);
+    } else {
+      run_through_range(self, begin, end);
+    }
+    begin = end;
+  }
+
+  for (int i = 0; i < self->num_loops; i++) {
+    self->gain[i] = target[i];
+    self->gain_step[i] = 0.0f;
+  }
 }
 
 /**
@@ -726,9 +1467,12 @@ static void run_loops(Alo *self, uint32_t n_samples) {
 static void run(LV2_Handle instance, uint32_t n_samples) {
   Alo *self = (Alo *)instance;
 
+  // Until loop memory has been faulted in the input is passed through
+  *self->ports.ready = loops_ready(self) ? 1.0f : 0.0f;
   run_loops(self, n_samples);
   run_clicks(self, n_samples);
   run_events(self);
+  clock_timeout(self);
 
   if (!*(self->ports.enabled)) {
     reset(self);
@@ -760,12 +1504,13 @@ static void cleanup(LV2_Handle instance) {
 
   Alo *self = (Alo *)instance;
 
-  for (int i = 0; i < NUM_LOOPS; i++) {
-    free(self->loops[i]);
+  if (self->prefault_started) {
+    __atomic_store_n(&self->quit, true, __ATOMIC_RELAXED);
+    pthread_join(self->prefault_thread, NULL);
   }
+  unmap_arena(self);
   free(self->low_beat);
   free(self->high_beat);
-  free(self->recording);
   free(self);
 }
 